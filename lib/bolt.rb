@@ -9,4 +9,5 @@ module Bolt
   end
 end
 
-require 'bolt/bolt_native' unless ENV['BOLT_DISABLE_NATIVE_EXTENSIONS']=='1'
\ No newline at end of file
+# The native extension is written against the MRI C API. Other rubies (JRuby, TruffleRuby) use the pure ruby implementation
+require 'bolt/bolt_native' unless ENV['BOLT_DISABLE_NATIVE_EXTENSIONS']=='1' || RUBY_ENGINE != 'ruby'
\ No newline at end of file
@@ -1,13 +1,15 @@
 # frozen_string_literal: true
 module Bolt
 
-  # A naive, pure ruby implementation of the packstream format. Other than structures, data is encoded/decoded to the obvious ruby primitives
+  # A pure ruby implementation of the packstream format. Other than structures, data is encoded/decoded to the obvious ruby primitives
   # 
   # For dumping, anything that includes the {Structure} module is consider a structure. It must respond to the signature and fields methods
   #
   # For loading, structures are loaded as instances of {Bolt::PackStream::BasicStruct}. You can customize the classes loaded by passing a non nil registry to {Bolt::PackStream.unpack}
   #
-  # Most of the functionality in this module is overwritten by the native implementation where available
+  # Most of the functionality in this module is overwritten by the native implementation where available. Where it isn't
+  # (JRuby, TruffleRuby or when BOLT_DISABLE_NATIVE_EXTENSIONS=1) this is the implementation that runs, so it avoids
+  # allocating where it can: see script/compare_benchmarks.rb for how it measures up to the native one
   #
 
   module PackStream
@@ -29,9 +31,10 @@ module Bolt
     end
 
     class << self
-      NULL = "\xC0".dup.force_encoding('BINARY')
-      TRUE = "\xC3".dup.force_encoding('BINARY')
-      FALSE = "\xC2".dup.force_encoding('BINARY')
+      NULL = 0xC0
+      TRUE = 0xC3
+      FALSE = 0xC2
+      FLOAT = 0xC1
 
       # Serializes the arguments according to the PackStream format. If multiple arguments are passed the result
       # is the concatentation of the serialization of the individual values.
@@ -43,9 +46,9 @@ module Bolt
       # @raise [RangeError] if the argument contains out of range data (such as integers >= 2**64)
       # @return [String] - A packstream encoded string
       def pack(*values)
-        values.inject("".dup.force_encoding('BINARY')) do |buffer, value|
-          pack_internal(buffer, value)
-        end
+        buffer = String.new(encoding: Encoding::BINARY)
+        values.each { |value| pack_internal(buffer, value) }
+        buffer
       end
 
       # Unpacks the bytestring, returning an enumerator.
@@ -67,18 +70,20 @@ module Bolt
 
       private
 
+      # Everything is appended to the one binary buffer. Bytes are appended with String#<<, which allocates nothing,
+      # wider values with pack(buffer:)
       def pack_internal(buffer, value)
         case value
         when Integer then encode_integer(value, buffer)
-        when Float then buffer << ["\xC1", value].pack('AG')
         when String then encode_string(value, buffer)
-        when Symbol then encode_string(value.to_s, buffer)
-        when Array then encode_array(value, buffer)
-        when Hash then encode_hash(value, buffer)
-        when Structure then encode_structure(value, buffer)
+        when Float then [FLOAT, value].pack('CG', buffer: buffer)
         when nil then buffer << NULL
         when true then buffer << TRUE
         when false then buffer << FALSE
+        when Array then encode_array(value, buffer)
+        when Hash then encode_hash(value, buffer)
+        when Symbol then encode_string(value.name, buffer)
+        when Structure then encode_structure(value, buffer)
         else
           raise ArgumentError, "value #{value} cannot be packstreamed"
         end
@@ -86,47 +91,44 @@ module Bolt
       end
 
       def encode_integer(value, buffer)
-        data = if -0x10 <= value && value < 0x80
-          [value].pack('c')
+        if -0x10 <= value && value < 0x80
+          buffer << (value & 0xFF)
         elsif -0x80 <= value  && value < 0x80
-          ["\xC8", value].pack('Ac')
+          buffer << 0xC8 << (value & 0xFF)
         elsif  -0x8000 <= value && value < 0x8000
-          ["\xC9", value].pack('As>')
+          buffer << 0xC9 << ((value >> 8) & 0xFF) << (value & 0xFF)
         elsif  -0x8000_0000 <= value && value < 0x8000_0000
-          ["\xCA", value].pack('Al>')
+          [0xCA, value].pack('Cl>', buffer: buffer)
         elsif  -0x8000_0000_0000_0000 <= value && value < 0x8000_0000_0000_0000
-          ["\xCB", value].pack('Aq>')
+          [0xCB, value].pack('Cq>', buffer: buffer)
         else
           raise RangeError, "integer #{value} is out of range"
         end
-        buffer << data
+      end
+
+      # Writes the marker and size shared by strings, lists and maps. +tiny+ is the marker for sizes up to 15, which is
+      # combined with the size. The 3 larger markers are consecutive, followed by 1, 2 or 4 byte sizes
+      def encode_header(size, tiny, marker, buffer)
+        if size < 0x10
+          buffer << (tiny | size)
+        elsif size < 0x100
+          buffer << marker << size
+        elsif size < 0x10000
+          buffer << (marker + 1) << (size >> 8) << (size & 0xFF)
+        elsif size < 0x1_0000_0000
+          [marker + 2, size].pack('CL>', buffer: buffer)
+        end
       end
 
       def encode_array(array, buffer)
         length = array.length
-        leader = case length
-        when 0..15 then [0x90 + length].pack('C')
-        when 16..255 then [0xD4, length].pack('CC')
-        when 256..65535 then [0xD5, length].pack('CS>')
-        when 65536...0x100000000 then [0xD6, length].pack('CL>')
-        else 
-          raise RangeError, "Array is too long #{length}"
-        end
-        buffer << leader
-        array.each { |item| pack_internal(buffer, item)}
+        raise RangeError, "Array is too long #{length}" unless encode_header(length, 0x90, 0xD4, buffer)
+        array.each { |item| pack_internal(buffer, item) }
       end
 
       def encode_hash(hash, buffer)
         size = hash.size
-        leader = case size
-        when 0..15 then [0xA0 + size].pack('C')
-        when 16..255 then [0xD8, size].pack('CC')
-        when 256..65535 then [0xD9, size].pack('CS>')
-        when 65536...0x100000000 then [0xDA, size].pack('CL>')
-        else 
-          raise RangeError, "Hash is too big #{size}"
-        end
-        buffer << leader
+        raise RangeError, "Hash is too big #{size}" unless encode_header(size, 0xA0, 0xD8, buffer)
         hash.each do |key, value| 
           pack_internal(buffer, key)
           pack_internal(buffer, value)
@@ -134,31 +136,25 @@ module Bolt
       end
 
       def encode_string(string, buffer)
-        encoded = string.encode('utf-8')
+        encoded = string.encoding == Encoding::UTF_8 ? string : string.encode(Encoding::UTF_8)
         bytesize = encoded.bytesize
-        leader = case bytesize
-        when 0..15 then [0x80 + bytesize].pack('C')
-        when 16..255 then [0xD0, bytesize].pack('CC')
-        when 256..65535 then [0xD1, bytesize].pack('CS>')
-        when 65536...0x100000000 then [0xD2, bytesize].pack('CL>')
-        else 
-          raise RangeError, "String is too long (#{bytesize})"
-        end
-        buffer << leader
-        buffer << encoded.force_encoding('BINARY')
+        raise RangeError, "String is too long (#{bytesize})" unless encode_header(bytesize, 0x80, 0xD0, buffer)
+        # appending non ascii utf-8 to an ascii only binary string would change its encoding
+        buffer << (encoded.ascii_only? ? encoded : encoded.b)
       end
 
       def encode_structure(struct, buffer)
         fields = struct.fields
         size = fields.size
-        leader = case size
-        when 0..15 then [0xB0 + size, struct.signature].pack('CC')
-        when 16..255 then [0xDC, size, struct.signature].pack('CCC')
-        when 256..65535 then [0xDD, size, struct.signature].pack('CS>C')
+        raise RangeError, "structure has too many fields (#{size})" if size >= 0x10000
+        signature = struct.signature & 0xFF
+        if size < 0x10
+          buffer << (0xB0 | size) << signature
+        elsif size < 0x100
+          buffer << 0xDC << size << signature
         else
-          raise RangeError, "structure has too many fields (#{size})"
+          buffer << 0xDD << (size >> 8) << (size & 0xFF) << signature
         end
-        buffer << leader
         fields.each {|item| pack_internal(buffer, item)}
       end
     end
@@ -223,79 +219,102 @@ module Bolt
     private
 
     def read_string(length)
-      data = @data.byteslice(@offset, length).force_encoding('UTF-8')
-      raise ArgumentError, "end of string data missing, wanted #{length} bytes, found #{data.length}" if data.length < length
-      @offset+= length
+      data = @data.byteslice(@offset, length).force_encoding(Encoding::UTF_8)
+      raise ArgumentError, "end of string data missing, wanted #{length} bytes, found #{data.bytesize}" if data.bytesize < length
+      @offset += length
       data
     end
 
-    def read_uint8;  get_scalar(1, 'C'); end
+    def read_uint8
+      byte = @data.getbyte(@offset)
+      raise ArgumentError, "end of scalar data missing, wanted 1 bytes, found 0" unless byte
+      @offset += 1
+      byte
+    end
+
+    def read_int8
+      byte = read_uint8
+      byte < 0x80 ? byte : byte - 0x100
+    end
+
     def read_uint16; get_scalar(2, 'S>'); end
     def read_uint32; get_scalar(4, 'L>'); end
     def read_uint64; get_scalar(8, 'Q>'); end
 
-    def read_int8;  get_scalar(1, 'c'); end
     def read_int16; get_scalar(2, 's>'); end
     def read_int32; get_scalar(4, 'l>'); end
     def read_int64; get_scalar(8, 'q>'); end
 
     def read_double; get_scalar(8, 'G'); end
 
-
-    
-
-
     def fetch_next_field
-      marker = read_uint8
-      if marker < 0x80 then marker
-      elsif marker >= 0xF0 then marker - 0x100 #the small negative ones - convert to signed byte
-      elsif marker == 0xC0 then nil
-      elsif marker == 0xC1 then read_double
-      elsif marker == 0xC2 then false
-      elsif marker == 0xC3 then true
-      #ints
-      elsif marker == 0xC8 then read_int8
-      elsif marker == 0xC9 then read_int16
-      elsif marker == 0xCA then read_int32
-      elsif marker == 0xCB then read_int64
-      #strings
-      elsif marker >= 0x80 && marker <= 0x8F then read_string(marker & 0x0F)
-      elsif marker == 0xD0 then read_string(read_uint8)
-      elsif marker == 0xD1 then read_string(read_uint16)
-      elsif marker == 0xD2 then read_string(read_uint32)
-      #lists
-      elsif marker >= 0x90 && marker <= 0x9F then get_list(marker & 0x0F)
-      elsif marker == 0xD4 then get_list(read_uint8)
-      elsif marker == 0xD5 then get_list(read_uint16)
-      elsif marker == 0xD6 then get_list(read_uint32)
-      #maps
-      elsif marker >= 0xA0 && marker <= 0xAF then get_map(marker & 0x0F)
-      elsif marker == 0xD8 then get_map(read_uint8)
-      elsif marker == 0xD9 then get_map(read_uint16)
-      elsif marker == 0xDA then get_map(read_uint32)
-      #structs
-      elsif marker >= 0xB0 && marker <= 0xBF then get_struct(marker & 0x0F)
-      elsif marker == 0xDC then get_struct(read_uint8)
-      elsif marker == 0xDD then get_struct(read_uint16)
+      marker = @data.getbyte(@offset)
+      raise ArgumentError, "end of data, wanted a marker byte" unless marker
+      @offset += 1
+      return marker if marker < 0x80
+      return marker - 0x100 if marker >= 0xF0
+
+      # every arm is an integer literal, so MRI compiles these to a jump table
+      if marker < 0xC0
+        size = marker & 0x0F
+        case marker >> 4
+        when 0x8 then read_string(size)
+        when 0x9 then get_list(size)
+        when 0xA then get_map(size)
+        else get_struct(size)
+        end
       else
-        raise ArgumentError, "Unknown marker #{marker.to_s(16)}"
+        case marker
+        when 0xC0 then nil
+        when 0xC1 then read_double
+        when 0xC2 then false
+        when 0xC3 then true
+        when 0xC8 then read_int8
+        when 0xC9 then read_int16
+        when 0xCA then read_int32
+        when 0xCB then read_int64
+        when 0xD0 then read_string(read_uint8)
+        when 0xD1 then read_string(read_uint16)
+        when 0xD2 then read_string(read_uint32)
+        when 0xD4 then get_list(read_uint8)
+        when 0xD5 then get_list(read_uint16)
+        when 0xD6 then get_list(read_uint32)
+        when 0xD8 then get_map(read_uint8)
+        when 0xD9 then get_map(read_uint16)
+        when 0xDA then get_map(read_uint32)
+        when 0xDC then get_struct(read_uint8)
+        when 0xDD then get_struct(read_uint16)
+        else
+          raise ArgumentError, "Unknown marker #{marker.to_s(16)}"
+        end
       end
-    end     
+    end
 
     def get_scalar(length, pattern)
-      data = @data.byteslice(@offset, length)
-      raise ArgumentError, "end of scalar data missing, wanted #{length} bytes, found #{data.length}" if data.length < length
-      scalar = data.unpack(pattern).first
+      remaining = @data.bytesize - @offset
+      raise ArgumentError, "end of scalar data missing, wanted #{length} bytes, found #{remaining}" if remaining < length
+      scalar = @data.unpack1(pattern, offset: @offset)
       @offset += length
       scalar
     end
+
+    # Every value takes at least one byte, which bounds how many values the remaining data can hold. This catches
+    # truncated or corrupt data before allocating for a bogus length
+    def check_remaining(count)
+      remaining = @data.bytesize - @offset
+      raise ArgumentError, "end of data missing, wanted #{count} values, found #{remaining} bytes" if remaining < count
+    end
  
     def get_list(length)
-      length.times.collect { fetch_next_field }
+      check_remaining(length)
+      Array.new(length) { fetch_next_field }
     end
 
     def get_map(length)
-      length.times.each_with_object({}) { |_, hash| hash[fetch_next_field]=fetch_next_field }
+      check_remaining(length * 2)
+      map = {}
+      length.times { map[fetch_next_field] = fetch_next_field }
+      map
     end
 
     def get_struct(length)
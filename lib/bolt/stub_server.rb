@@ -0,0 +1,251 @@
+# frozen_string_literal: true
+require 'socket'
+require 'bolt'
+
+module Bolt
+
+  # A scriptable stand-in for a Neo4j server, intended for tests and benchmarks. Inspired by the stub server in boltkit
+  #
+  # The server performs the bolt handshake, reads chunked request messages and replies to each one with a
+  # scripted list of response messages. It understands just enough of the protocol to drive a client: it does not
+  # run queries, it replays whatever it was given.
+  #
+  # Responses are supplied as a hash of request signatures to either an array of messages or a callable. Arrays are
+  # packed and chunked once, when the server is created, so that replaying them costs the server a single write. A callable is
+  # invoked with the request message and must return an array of messages. Requests without a scripted response are
+  # answered with a FAILURE.
+  #
+  # As with a real server, once a connection has sent a FAILURE every request other than ACK_FAILURE and RESET is
+  # answered with IGNORED. A malformed request is answered with a FAILURE and the connection is closed. Errors raised by
+  # a callable response are not reported to the client: the connection is dropped and {#stop} re-raises the error.
+  #
+  #   server = Bolt::StubServer.new(Bolt::StubServer.replay(fields: ['n'], rows: [[1], [2]])).start
+  #   socket = TCPSocket.new(server.host, server.port)
+  #
+  # This is not loaded by default: require 'bolt/stub_server' to use it
+  #
+  class StubServer
+    PREAMBLE = "\x60\x60\xB0\x17".b.freeze
+    NO_VERSION = 0
+
+    MAX_CHUNK_SIZE = 0xFFFF
+    END_OF_MESSAGE = "\x00\x00".b.freeze
+
+    # request signatures
+    INIT = 0x01
+    ACK_FAILURE = 0x0E
+    RESET = 0x0F
+    RUN = 0x10
+    DISCARD_ALL = 0x2F
+    PULL_ALL = 0x3F
+
+    # response signatures
+    SUCCESS = 0x70
+    RECORD = 0x71
+    IGNORED = 0x7E
+    FAILURE = 0x7F
+
+    DEFAULT_RESPONSES = {
+      INIT => [PackStream::BasicStruct.new(SUCCESS, [{'server' => 'Neo4j/3.0.0'}])],
+      ACK_FAILURE => [PackStream::BasicStruct.new(SUCCESS, [{}])],
+      RESET => [PackStream::BasicStruct.new(SUCCESS, [{}])],
+      RUN => [PackStream::BasicStruct.new(SUCCESS, [{'fields' => []}])],
+      DISCARD_ALL => [PackStream::BasicStruct.new(SUCCESS, [{}])],
+      PULL_ALL => [PackStream::BasicStruct.new(SUCCESS, [{}])]
+    }.freeze
+
+    class << self
+
+      # Builds a responses hash that replays a fixed result stream: RUN is answered with the field names and PULL_ALL
+      # with one RECORD per row followed by a SUCCESS containing the metadata
+      #
+      # @param fields [Array<String>] The field names of the result
+      # @param rows [Array<Array>] The values of each record. Each row should have as many values as there are fields
+      # @param metadata [Hash] The summary metadata sent at the end of the stream
+      # @return [Hash] suitable for passing to {#initialize}
+      def replay(fields:, rows:, metadata: {'type' => 'r'})
+        {
+          RUN => [PackStream::BasicStruct.new(SUCCESS, [{'fields' => fields}])],
+          PULL_ALL => rows.map { |row| PackStream::BasicStruct.new(RECORD, [row]) } +
+            [PackStream::BasicStruct.new(SUCCESS, [metadata])]
+        }
+      end
+
+      # Packs the messages and splits each one into chunks, terminating each with an end of message marker
+      #
+      # @return [String] the data to write to the socket
+      def encode_messages(messages)
+        messages.each_with_object(String.new(encoding: Encoding::BINARY)) do |message, buffer|
+          chunk(PackStream.pack(message), buffer)
+        end
+      end
+
+      # Appends the chunked form of a single packed message to the buffer
+      #
+      # @return [String] the buffer
+      def chunk(data, buffer = String.new(encoding: Encoding::BINARY))
+        offset = 0
+        while offset < data.bytesize
+          length = [data.bytesize - offset, MAX_CHUNK_SIZE].min
+          buffer << [length].pack('S>')
+          buffer << data.byteslice(offset, length)
+          offset += length
+        end
+        buffer << END_OF_MESSAGE
+      end
+
+      # Reads chunks from the io until an end of message marker is found
+      #
+      # @raise [EOFError] if the io is closed before the message is complete
+      # @return [String] the message data, ready for unpacking
+      def read_message_data(io)
+        data = String.new(encoding: Encoding::BINARY)
+        loop do
+          length = read_exactly(io, 2).unpack('S>').first
+          return data if length == 0
+          data << read_exactly(io, length)
+        end
+      end
+
+      # Reads and unpacks a single message
+      #
+      # @return [Bolt::PackStream::BasicStruct]
+      def read_message(io, registry = nil)
+        ByteBuffer.new(read_message_data(io), registry).next_value
+      end
+
+      private
+
+      def read_exactly(io, length)
+        data = io.read(length)
+        raise EOFError, "connection closed, wanted #{length} bytes, found #{data ? data.bytesize : 0}" if data.nil? || data.bytesize < length
+        data
+      end
+    end
+
+    # Raised when a request can't be decoded
+    class InvalidRequest < StandardError; end
+    private_constant :InvalidRequest
+
+    IGNORED_RESPONSE = [StubServer.encode_messages([PackStream::BasicStruct.new(IGNORED, [])]).freeze, true].freeze
+    private_constant :IGNORED_RESPONSE
+
+    attr_reader :host, :port
+
+    #
+    # @param responses [Hash] request signatures to arrays of response messages or callables. Merged with {DEFAULT_RESPONSES}
+    # @param host [String] the address to listen on
+    # @param port [Integer] the port to listen on. The default of 0 picks a free port, available from {#port} once started
+    # @param versions [Array<Integer>] The protocol versions the server accepts; the first one the client proposes that is in this list is chosen
+    def initialize(responses = {}, host: '127.0.0.1', port: 0, versions: [1])
+      @responses = DEFAULT_RESPONSES.merge(responses).each_with_object({}) do |(signature, response), result|
+        result[signature] = response.respond_to?(:call) ? response : encode_response(response)
+      end
+      @host = host
+      @port = port
+      @versions = versions
+      @connections = []
+      @threads = []
+      @mutex = Mutex.new
+    end
+
+    #
+    # Starts listening and accepting connections in a background thread. Each connection is served by its own thread
+    #
+    # @return self
+    def start
+      @server = TCPServer.new(@host, @port)
+      @port = @server.addr[1]
+      @acceptor = Thread.new { accept_loop }
+      self
+    end
+
+    #
+    # Stops listening, closes any open connections and waits for the threads serving them to finish
+    #
+    # @raise the first error raised by a callable response, if any
+    def stop
+      @server.close if @server && !@server.closed?
+      @acceptor.join if @acceptor
+      @acceptor = @server = nil
+      threads = @mutex.synchronize do
+        @connections.each { |socket| socket.close unless socket.closed? }
+        @threads.slice!(0..-1)
+      end
+      threads.each(&:join)
+    end
+
+    private
+
+    def accept_loop
+      loop do
+        socket = @server.accept
+        socket.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+        @mutex.synchronize do
+          @connections << socket
+          # errors from callable responses are re-raised by stop instead of being printed
+          @threads << Thread.new { serve(socket) }.tap { |thread| thread.report_on_exception = false }
+        end
+      end
+    rescue IOError, Errno::EBADF, Errno::EINVAL
+      # the listening socket was closed by stop
+    end
+
+    def serve(socket)
+      return unless handshake(socket)
+      failed = false
+      loop do
+        data, failed = response_for(read_request(socket), failed)
+        socket.write(data)
+      end
+    rescue InvalidRequest => e
+      begin
+        socket.write(invalid_request(e.message)[0])
+      rescue IOError, SystemCallError
+        # the client has already gone
+      end
+    rescue EOFError, IOError, SystemCallError
+      # the client disconnected
+    ensure
+      @mutex.synchronize { @connections.delete(socket) }
+      socket.close unless socket.closed?
+    end
+
+    def read_request(socket)
+      request = begin
+        StubServer.read_message(socket)
+      rescue ArgumentError => e
+        raise InvalidRequest, e.message
+      end
+      raise InvalidRequest, "request is not a structure: #{request.inspect}" unless request.is_a?(PackStream::Structure)
+      request
+    end
+
+    # Returns the data to write and whether the connection is now in the failed state
+    def response_for(request, failed)
+      signature = request.signature
+      return IGNORED_RESPONSE if failed && signature != ACK_FAILURE && signature != RESET
+      response = @responses.fetch(signature) do
+        return invalid_request("no scripted response for request with signature 0x#{signature.to_s(16)}")
+      end
+      response.respond_to?(:call) ? encode_response(response.call(request)) : response
+    end
+
+    def encode_response(messages)
+      [StubServer.encode_messages(messages).freeze, messages.any? { |message| message.signature == FAILURE }]
+    end
+
+    def invalid_request(message)
+      encode_response([PackStream::BasicStruct.new(FAILURE, [{'code' => 'Neo.ClientError.Request.Invalid', 'message' => message}])])
+    end
+
+    def handshake(socket)
+      return false unless socket.read(4) == PREAMBLE
+      proposed = socket.read(16)
+      return false unless proposed && proposed.bytesize == 16
+      version = (proposed.unpack('L>4') & @versions).first || NO_VERSION
+      socket.write([version].pack('L>'))
+      version != NO_VERSION
+    end
+  end
+end
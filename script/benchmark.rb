@@ -17,6 +17,7 @@ FLOATS = [1.0]*65536
 
 IMMEDIATES = [true, false, nil] * 65536
 Benchmark.ips do |x|
+  x.json!(ENV['BENCHMARK_JSON']) if ENV['BENCHMARK_JSON']
 
   x.report("unpack list of integers") do
     Bolt::ByteBuffer.new(LIST_OF_INTEGERS).next_value
@@ -0,0 +1,58 @@
+require 'json'
+require 'rbconfig'
+require 'tmpdir'
+
+# Runs script/benchmark.rb against the native extension and against the pure ruby implementation and reports how many
+# times slower the pure ruby implementation is on each benchmark. Exits unsuccessfully if any benchmark is slower than
+# the limit for its group. The limits match the factors documented in the README, with some headroom for noise.
+#
+# Single runs are too noisy to gate on, so the benchmarks are run RUNS times (default 3), alternating between the two
+# implementations, and the median speed of each benchmark is compared.
+#
+# Set PURE_RUBY to use a different ruby for the pure ruby run, for example PURE_RUBY=truffleruby
+
+# The first matching pattern gives the limit for a benchmark
+MAX_SLOWDOWNS = [
+  [/\Aunpack /, 10],
+  [/\Apack small /, 6],
+  [/\Apack big /, 60]
+]
+RUNS = Integer(ENV.fetch('RUNS', 3))
+BENCHMARK = File.expand_path('../benchmark.rb', __FILE__)
+
+def run_benchmark(ruby, env)
+  Dir.mktmpdir do |dir|
+    path = File.join(dir, 'results.json')
+    system(env.merge('BENCHMARK_JSON' => path), ruby, BENCHMARK) or abort "#{ruby} #{BENCHMARK} failed"
+    JSON.parse(File.read(path)).each_with_object({}) { |result, ips| ips[result['name']] = result['ips'] }
+  end
+end
+
+def medians(runs)
+  runs.first.keys.each_with_object({}) do |name, result|
+    sorted = runs.map { |run| run.fetch(name) }.sort
+    result[name] = (sorted[(sorted.length - 1) / 2] + sorted[sorted.length / 2]) / 2.0
+  end
+end
+
+native_runs = []
+pure_runs = []
+RUNS.times do
+  native_runs << run_benchmark(RbConfig.ruby, 'BOLT_DISABLE_NATIVE_EXTENSIONS' => '0')
+  pure_runs << run_benchmark(ENV.fetch('PURE_RUBY', RbConfig.ruby), 'BOLT_DISABLE_NATIVE_EXTENSIONS' => '1')
+end
+native = medians(native_runs)
+pure = medians(pure_runs)
+
+puts
+puts "medians of #{RUNS} runs"
+puts format('%-35s %14s %14s %10s %8s', 'benchmark', 'native i/s', 'pure ruby i/s', 'slowdown', 'limit')
+failures = native.filter_map do |name, native_ips|
+  _, limit = MAX_SLOWDOWNS.find { |pattern, _| pattern.match?(name) }
+  abort "no slowdown limit for benchmark #{name}" unless limit
+  slowdown = native_ips / pure.fetch(name)
+  puts format('%-35s %14.1f %14.1f %9.1fx %7dx', name, native_ips, pure.fetch(name), slowdown, limit)
+  "#{name} is #{slowdown.round(1)}x slower, more than #{limit}x" if slowdown > limit
+end
+
+abort "pure ruby implementation is too slow:\n#{failures.join("\n")}" if failures.any?
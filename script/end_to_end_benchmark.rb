@@ -0,0 +1,119 @@
+require 'bundler/setup'
+$LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
+require 'bolt'
+require 'bolt/stub_server'
+
+# Drives a Bolt::StubServer over a loopback socket, measuring the whole client path: packing requests, chunk framing,
+# socket reads and decoding of the replayed result stream. The server is forked where possible so that its allocations
+# and threads do not pollute the measurements.
+#
+# Configured through the environment:
+#
+#   ROWS    - records per query (default 1000)
+#   QUERIES - queries per shape, after warmup (default 200)
+#   SHAPES  - comma separated list of shapes to run (default all of them)
+
+ROWS = Integer(ENV.fetch('ROWS', 1000))
+QUERIES = Integer(ENV.fetch('QUERIES', 200))
+WARMUP = [QUERIES / 10, 1].max
+
+SHAPES = {
+  'scalars' => [['a', 'b', 'c', 'd', 'e'], [1, 1234567, 3.14, true, nil]],
+  'strings' => [['name', 'description', 'city'], ['Alice', 'A somewhat longer string value, over 15 bytes', 'Zürich']],
+  'lists' => [['ids'], [(1..50).to_a]],
+  'maps' => [['row'], [{'id' => 1, 'name' => 'Alice', 'tags' => ['a', 'b'], 'score' => 1.5}]],
+  'nodes' => [['n'], [Bolt::PackStream::BasicStruct.new(0x4E, [42, ['Person'], {'name' => 'Alice', 'age' => 33}])]]
+}
+
+RUN = Bolt::PackStream::BasicStruct.new(Bolt::StubServer::RUN, ['MATCH (n) RETURN n', {'limit' => ROWS}])
+PULL_ALL = Bolt::PackStream::BasicStruct.new(Bolt::StubServer::PULL_ALL, [])
+INIT = Bolt::PackStream::BasicStruct.new(Bolt::StubServer::INIT, ['bolt-benchmark/1.0', {}])
+
+def start_server(fields, row)
+  server = Bolt::StubServer.new(Bolt::StubServer.replay(fields: fields, rows: [row] * ROWS))
+  return [server.start, nil] unless Process.respond_to?(:fork)
+
+  reader, writer = IO.pipe
+  pid = fork do
+    reader.close
+    server.start
+    writer.puts server.port
+    writer.close
+    sleep
+  end
+  writer.close
+  port = Integer(reader.gets)
+  reader.close
+  [Struct.new(:host, :port).new(server.host, port), pid]
+end
+
+def connect(server)
+  socket = TCPSocket.new(server.host, server.port)
+  socket.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+  socket.write(Bolt::StubServer::PREAMBLE + [1, 0, 0, 0].pack('L>4'))
+  raise 'handshake failed' unless socket.read(4).unpack('L>').first == 1
+  socket.write(Bolt::StubServer.encode_messages([INIT]))
+  Bolt::StubServer.read_message(socket)
+  socket
+end
+
+# Runs a single query, returning the number of messages received
+def query(socket)
+  socket.write(Bolt::StubServer.encode_messages([RUN, PULL_ALL]))
+  Bolt::StubServer.read_message(socket)
+  messages = 1
+  loop do
+    messages += 1
+    break unless Bolt::StubServer.read_message(socket).signature == Bolt::StubServer::RECORD
+  end
+  messages
+end
+
+def percentile(sorted, fraction)
+  sorted[[(sorted.length * fraction).ceil - 1, 0].max]
+end
+
+shapes = ENV['SHAPES'] ? ENV['SHAPES'].split(',') : SHAPES.keys
+
+puts "native extensions: #{Bolt.native_extensions_loaded?}, #{RUBY_DESCRIPTION}"
+puts "#{ROWS} rows per query, #{QUERIES} queries per shape"
+puts format('%-8s %12s %12s %9s %9s %9s %9s %12s', 'shape', 'messages/s', 'MB/s', 'p50 ms', 'p90 ms', 'p99 ms', 'max ms', 'allocs/msg')
+
+shapes.each do |name|
+  fields, row = SHAPES.fetch(name)
+  server, pid = start_server(fields, row)
+  begin
+    socket = connect(server)
+    bytes = Bolt::StubServer.encode_messages(Bolt::StubServer.replay(fields: fields, rows: [row] * ROWS).values.flatten).bytesize
+
+    WARMUP.times { query(socket) }
+    GC.start
+
+    latencies = []
+    messages = 0
+    allocations = GC.stat(:total_allocated_objects)
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    QUERIES.times do
+      query_started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      messages += query(socket)
+      latencies << Process.clock_gettime(Process::CLOCK_MONOTONIC) - query_started
+    end
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+    allocations = GC.stat(:total_allocated_objects) - allocations
+
+    latencies.sort!
+    puts format('%-8s %12.0f %12.1f %9.3f %9.3f %9.3f %9.3f %12.1f',
+      name, messages / elapsed, bytes * QUERIES / elapsed / 1_000_000,
+      percentile(latencies, 0.5) * 1000, percentile(latencies, 0.9) * 1000,
+      percentile(latencies, 0.99) * 1000, latencies.last * 1000,
+      allocations.to_f / messages)
+    socket.close
+  ensure
+    if pid
+      Process.kill('TERM', pid)
+      Process.wait(pid)
+    else
+      server.stop
+    end
+  end
+end
@@ -334,6 +334,13 @@ describe Bolt::PackStream do
       it 'raises if length is longer than the buffer' do
         expect { Bolt::PackStream.unpack("\x9F").next}.to raise_error(ArgumentError)
       end
+
+      #the native implementation allocates the list before reading it
+      unless Bolt.native_extensions_loaded?
+        it 'raises if a 4 byte length is longer than the buffer' do
+          expect { Bolt::PackStream.unpack("\xD6\xFF\xFF\xFF\xFF\x01").next}.to raise_error(ArgumentError)
+        end
+      end
     end
 
     describe 'maps' do
@@ -391,6 +398,10 @@ describe Bolt::PackStream do
         expect(Bolt::PackStream.unpack("\xD2\x00\x00\x00\x05\x48\x65\x6c\x6c\x6f\xC0").next).to eq('Hello')
       end
 
+      it 'reads multibyte strings' do
+        expect(Bolt::PackStream.unpack("\x82\xC3\xA9").next).to eq('é')
+      end
+
       it 'raises if length is longer than buffer' do
         expect { Bolt::PackStream.unpack("\x8F").next}.to raise_error(ArgumentError)
       end
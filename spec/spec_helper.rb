@@ -1,7 +1,7 @@
 $LOAD_PATH.unshift File.expand_path('../../lib', __FILE__)
 require 'bolt'
 Dir[File.dirname(__FILE__)+'/support/*.rb'].each {|f| require f }
-require 'byebug'
+require 'byebug' if RUBY_ENGINE == 'ruby'
 RSpec.configure do |config|
   config.example_status_persistence_file_path = "./spec/examples.txt"
   config.mock_with :rspec do |c|
@@ -0,0 +1,143 @@
+require 'spec_helper'
+require 'bolt/stub_server'
+require 'stringio'
+
+describe Bolt::StubServer do
+  let(:responses) { {} }
+  let(:server) { Bolt::StubServer.new(responses).start }
+  let(:socket) { TCPSocket.new(server.host, server.port) }
+
+  def handshake(*versions)
+    socket.write(Bolt::StubServer::PREAMBLE + (versions + [0] * (4 - versions.length)).pack('L>4'))
+    socket.read(4).unpack('L>').first
+  end
+
+  def request(signature, *fields)
+    socket.write(Bolt::StubServer.encode_messages([Bolt::PackStream::BasicStruct.new(signature, fields)]))
+  end
+
+  def response
+    Bolt::StubServer.read_message(socket)
+  end
+
+  describe 'handshake' do
+    after do
+      socket.close
+      server.stop
+    end
+
+    it 'agrees to version 1' do
+      expect(handshake(1)).to eq(1)
+    end
+
+    it 'picks the first supported version proposed' do
+      expect(handshake(7, 1)).to eq(1)
+    end
+
+    it 'replies 0 and closes the connection if no version is supported' do
+      expect(handshake(2, 3)).to eq(0)
+      expect(socket.read(1)).to be_nil
+    end
+  end
+
+  describe 'chunking' do
+    it 'terminates messages with an empty chunk' do
+      expect(Bolt::StubServer.chunk("\xB0\x70".b)).to match_hex('00:02:B0:70:00:00')
+    end
+
+    it 'splits messages larger than 65535 bytes' do
+      data = 'A'.b * 70000
+      expect(Bolt::StubServer.chunk(data)).to eq("\xFF\xFF".b + 'A' * 65535 + "\x11\x71".b + 'A' * 4465 + "\x00\x00".b)
+    end
+
+    it 'reassembles chunked messages' do
+      message = Bolt::PackStream::BasicStruct.new(0x71, [['x' * 100_000]])
+      io = StringIO.new(Bolt::StubServer.encode_messages([message]))
+      expect(Bolt::StubServer.read_message(io)).to eq(message)
+    end
+  end
+
+  describe 'requests' do
+    before { handshake(1) }
+
+    after do
+      socket.close
+      server.stop
+    end
+
+    it 'replies to INIT with SUCCESS' do
+      request(Bolt::StubServer::INIT, 'test/1.0', {})
+      expect(response.signature).to eq(Bolt::StubServer::SUCCESS)
+    end
+
+    it 'replies to requests with no scripted response with FAILURE' do
+      request(0x66)
+      expect(response.signature).to eq(Bolt::StubServer::FAILURE)
+    end
+
+    it 'replies to malformed requests with FAILURE and closes the connection' do
+      socket.write("\x00\x03\xC4\xC4\xC4\x00\x00".b)
+      expect(response.fields[0]['code']).to eq('Neo.ClientError.Request.Invalid')
+      expect(socket.read(1)).to be_nil
+    end
+
+    it 'ignores requests after a FAILURE until it is acknowledged' do
+      request(0x66)
+      request(Bolt::StubServer::RUN, 'RETURN 1', {})
+      request(Bolt::StubServer::ACK_FAILURE)
+      request(Bolt::StubServer::RUN, 'RETURN 1', {})
+
+      expect(response.signature).to eq(Bolt::StubServer::FAILURE)
+      expect(response.signature).to eq(Bolt::StubServer::IGNORED)
+      expect(response.signature).to eq(Bolt::StubServer::SUCCESS)
+      expect(response.signature).to eq(Bolt::StubServer::SUCCESS)
+    end
+
+    it 'leaves the failed state on RESET' do
+      request(0x66)
+      request(Bolt::StubServer::RESET)
+      request(Bolt::StubServer::RUN, 'RETURN 1', {})
+
+      expect(response.signature).to eq(Bolt::StubServer::FAILURE)
+      expect(response.signature).to eq(Bolt::StubServer::SUCCESS)
+      expect(response.signature).to eq(Bolt::StubServer::SUCCESS)
+    end
+
+    context 'replaying a result stream' do
+      let(:rows) { [[1, 'Alice', {'tags' => ['a']}]] * 3 }
+      let(:responses) { Bolt::StubServer.replay(fields: ['id', 'name', 'properties'], rows: rows) }
+
+      it 'replies to RUN with the fields and to PULL_ALL with the records' do
+        request(Bolt::StubServer::RUN, 'RETURN 1', {})
+        request(Bolt::StubServer::PULL_ALL)
+
+        expect(response).to eq(Bolt::PackStream::BasicStruct.new(Bolt::StubServer::SUCCESS, [{'fields' => ['id', 'name', 'properties']}]))
+        rows.each do |row|
+          expect(response).to eq(Bolt::PackStream::BasicStruct.new(Bolt::StubServer::RECORD, [row]))
+        end
+        expect(response).to eq(Bolt::PackStream::BasicStruct.new(Bolt::StubServer::SUCCESS, [{'type' => 'r'}]))
+      end
+    end
+
+    context 'with a callable response' do
+      let(:responses) do
+        {Bolt::StubServer::RUN => ->(run) { [Bolt::PackStream::BasicStruct.new(Bolt::StubServer::SUCCESS, [{'fields' => [run.fields[0]]}])] }}
+      end
+
+      it 'replies with the messages it returns' do
+        request(Bolt::StubServer::RUN, 'RETURN 1', {})
+        expect(response.fields).to eq([{'fields' => ['RETURN 1']}])
+      end
+    end
+
+    context 'with a callable response that raises' do
+      let(:responses) { {Bolt::StubServer::RUN => ->(run) { raise ArgumentError, 'broken script' }} }
+
+      it 'drops the connection and re-raises the error from stop' do
+        request(Bolt::StubServer::RUN, 'RETURN 1', {})
+        expect(socket.read(1)).to be_nil
+        expect { server.stop }.to raise_error(ArgumentError)
+      end
+    end
+  end
+end